@@ -17,13 +17,20 @@
 #ifndef KS_ECS_HPP
 #define KS_ECS_HPP
 
+#include <algorithm>
 #include <array>
+#include <cstring>
+#include <limits>
+#include <string>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 
 #include <ks/KsObject.hpp>
 #include <ks/KsLog.hpp>
 #include <ks/KsException.hpp>
 #include <ks/shared/KsRecycleIndexList.hpp>
+#include <ks/ecs/KsEcsProfiler.hpp>
 
 namespace ks
 {
@@ -135,6 +142,18 @@ namespace ks
 
         // ============================================================= //
 
+        class InstantiateNotSupported : public ks::Exception
+        {
+        public:
+            InstantiateNotSupported(std::string msg) :
+                ks::Exception(ks::Exception::ErrorLevel::FATAL,std::move(msg),true)
+            {}
+
+            ~InstantiateNotSupported() = default;
+        };
+
+        // ============================================================= //
+
         template<typename SceneKey>
         class Scene;
 
@@ -152,6 +171,22 @@ namespace ks
 
             virtual void Remove(Id entity_id)=0;
 
+            // Copies the component belonging to @src_entity_id to
+            // every entity in @list_entity_ids. The caller is
+            // responsible for updating the entity masks. Lists
+            // that don't override this can't be used with
+            // Scene::Instantiate
+            virtual void CreateCopies(Id src_entity_id,
+                                      std::vector<Id> const &list_entity_ids)
+            {
+                (void)src_entity_id;
+                (void)list_entity_ids;
+
+                throw InstantiateNotSupported(
+                            "ks::ecs::ComponentListBase: list doesn't "
+                            "support Instantiate");
+            }
+
         protected:
             template<typename ComponentType>
             void addComponentToEntityMask(Id entity_id);
@@ -208,9 +243,77 @@ namespace ks
                 entity.valid = true;
                 entity.mask = 0;
 
+                KS_ECS_PROFILE_COUNT(EntitiesCreated,1);
+
                 return m_list_entities.Add(entity);
             }
 
+            // Creates @count new entities that have the same mask
+            // and components as @prefab_id. Any entity can be used as
+            // a prefab; the components are copied a list at a time.
+            // Returns an empty list if @prefab_id isn't a valid entity.
+            // Throws InstantiateNotSupported (and creates nothing) if
+            // one of the prefab's component lists can't copy components
+            std::vector<Id> Instantiate(Id prefab_id, uint count)
+            {
+                auto const &list_entities = m_list_entities.GetList();
+                if(!(list_entities.size() > prefab_id) ||
+                   !list_entities[prefab_id].valid) {
+                    return {};
+                }
+
+                KS_ECS_PROFILE_SCOPE(scope,"ecs::Scene::Instantiate");
+                KS_ECS_PROFILE_COUNT(EntitiesCreated,count);
+
+                Mask const mask = list_entities[prefab_id].mask;
+
+                std::vector<Id> list_ent_ids;
+                list_ent_ids.reserve(count);
+
+                for(uint i=0; i < count; i++) {
+                    Entity entity;
+                    entity.valid = true;
+                    entity.mask = mask;
+
+                    list_ent_ids.push_back(m_list_entities.Add(entity));
+                }
+
+                if(mask > 0 && count > 0) {
+                    for(uint i=0; i < SceneKey::max_component_types; i++) {
+                        if(!(mask & (Mask(1) << i))) {
+                            continue;
+                        }
+
+                        try {
+                            m_list_cm_lists[i]->CreateCopies(prefab_id,list_ent_ids);
+                        }
+                        catch(InstantiateNotSupported const &) {
+                            // Undo the copies made so far and
+                            // remove the new entities
+                            for(uint j=0; j < i; j++) {
+                                if(mask & (Mask(1) << j)) {
+                                    for(auto const id : list_ent_ids) {
+                                        m_list_cm_lists[j]->Remove(id);
+                                    }
+                                }
+                            }
+
+                            for(auto const id : list_ent_ids) {
+                                m_list_entities.Get(id).mask = 0;
+                                m_list_entities.Remove(id);
+                            }
+
+                            throw InstantiateNotSupported(
+                                        "ks::ecs::Scene::Instantiate: The list "
+                                        "for component "+std::to_string(i)+
+                                        " doesn't support Instantiate");
+                        }
+                    }
+                }
+
+                return list_ent_ids;
+            }
+
             void RemoveEntity(Id id)
             {
                 // Remove all components for this entity
@@ -224,6 +327,8 @@ namespace ks
                 }
 
                 m_list_entities.Remove(id);
+
+                KS_ECS_PROFILE_COUNT(EntitiesRemoved,1);
             }
 
             std::vector<Id> GetEntityIdList() const
@@ -306,6 +411,8 @@ namespace ks
         template<typename SceneKey,typename ComponentType>
         class ComponentList : public ComponentListBase<SceneKey>
         {
+            using Component = detail::Component<SceneKey,ComponentType>;
+
         public:
             ComponentList(Scene<SceneKey> &scene) :
                 ComponentListBase<SceneKey>(scene)
@@ -317,7 +424,7 @@ namespace ks
             ComponentType& Create(Id entity_id, Args&&... args)
             {
                 if(!(m_list_data.size() > entity_id)) {
-                    m_list_data.resize(entity_id+25);
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_data,entity_id+25);
                 }
 
                 // TODO: I think this std::move is redundant,
@@ -328,6 +435,10 @@ namespace ks
 
                 this->template addComponentToEntityMask<ComponentType>(entity_id);
 
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsCreated,Component::index,1);
+
+                onCreated(entity_id);
+
                 return m_list_data[entity_id];
             }
 
@@ -345,10 +456,39 @@ namespace ks
                         this->m_scene.GetEntityList().size();
 
                 if(diff > 25) {
-                    m_list_data.resize(m_list_data.size()-25);
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_data,m_list_data.size()-25);
                 }
 
                 this->template removeComponentFromEntityMask<ComponentType>(entity_id);
+
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsRemoved,Component::index,1);
+            }
+
+            void CreateCopies(Id src_entity_id,
+                              std::vector<Id> const &list_entity_ids)
+            {
+                if(list_entity_ids.empty()) {
+                    return;
+                }
+
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsCreated,Component::index,
+                                               list_entity_ids.size());
+
+                Id const max_entity_id =
+                        *std::max_element(list_entity_ids.begin(),
+                                          list_entity_ids.end());
+
+                if(!(m_list_data.size() > max_entity_id)) {
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_data,max_entity_id+25);
+                }
+
+                copyComponent(src_entity_id,
+                              list_entity_ids,
+                              std::is_trivially_copyable<ComponentType>());
+
+                for(auto const entity_id : list_entity_ids) {
+                    onCreated(entity_id);
+                }
             }
 
             ComponentType& GetComponent(Id entity_id)
@@ -371,12 +511,227 @@ namespace ks
                 return m_list_data;
             }
 
+        protected:
+            // Called for each new component at the end of Create and
+            // CreateCopies so derived lists can react to new components
+            // even when they're created through a ComponentList pointer
+            virtual void onCreated(Id entity_id)
+            {
+                (void)entity_id;
+            }
+
         private:
+            void copyComponent(Id src_entity_id,
+                               std::vector<Id> const &list_entity_ids,
+                               std::true_type)
+            {
+                ComponentType const * src = &(m_list_data[src_entity_id]);
+                for(auto const entity_id : list_entity_ids) {
+                    std::memcpy(&(m_list_data[entity_id]),src,sizeof(ComponentType));
+                }
+            }
+
+            void copyComponent(Id src_entity_id,
+                               std::vector<Id> const &list_entity_ids,
+                               std::false_type)
+            {
+                ComponentType const &src = m_list_data[src_entity_id];
+                for(auto const entity_id : list_entity_ids) {
+                    m_list_data[entity_id] = src;
+                }
+            }
+
             std::vector<ComponentType> m_list_data; // sparse list
         };
 
         // ============================================================= //
 
+        // A ComponentList for large components that many entities
+        // have identical copies of. Each distinct value is stored
+        // once and reference counted; entities only store the id
+        // of their value. ComponentType must be equality comparable
+        // and hashable with Hash
+        template<typename SceneKey,
+                 typename ComponentType,
+                 typename Hash=std::hash<ComponentType>>
+        class SharedComponentList : public ComponentListBase<SceneKey>
+        {
+            using Component = detail::Component<SceneKey,ComponentType>;
+
+        public:
+            static Id const invalid_value_id{std::numeric_limits<Id>::max()};
+
+            SharedComponentList(Scene<SceneKey> &scene) :
+                ComponentListBase<SceneKey>(scene)
+            {}
+
+            ~SharedComponentList() = default;
+
+            // Gives the entity a reference to the value constructed
+            // from @args, creating the value if no entity has it yet
+            template<typename... Args>
+            ComponentType const & Create(Id entity_id, Args&&... args)
+            {
+                if(!(m_list_value_ids.size() > entity_id)) {
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_value_ids,
+                                          entity_id+25,invalid_value_id);
+                }
+
+                ComponentType value(std::forward<Args>(args)...);
+                std::size_t const hash = Hash()(value);
+
+                Id value_id = invalid_value_id;
+                auto range = m_lkup_value_ids.equal_range(hash);
+                for(auto it = range.first; it != range.second; ++it) {
+                    if(m_list_values.Get(it->second).value == value) {
+                        value_id = it->second;
+                        break;
+                    }
+                }
+
+                if(value_id == invalid_value_id) {
+                    SharedValue shared_value;
+                    shared_value.value = std::move(value);
+                    shared_value.hash = hash;
+                    shared_value.ref_count = 0;
+
+                    value_id = m_list_values.Add(std::move(shared_value));
+                    m_lkup_value_ids.emplace(hash,value_id);
+                }
+
+                // Take the new reference before releasing the old one
+                // in case they're the same value
+                m_list_values.Get(value_id).ref_count++;
+                releaseValue(m_list_value_ids[entity_id]);
+                m_list_value_ids[entity_id] = value_id;
+
+                this->template addComponentToEntityMask<ComponentType>(entity_id);
+
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsCreated,Component::index,1);
+
+                return m_list_values.Get(value_id).value;
+            }
+
+            void Remove(Id entity_id)
+            {
+                releaseValue(m_list_value_ids[entity_id]);
+                m_list_value_ids[entity_id] = invalid_value_id;
+
+                // Trim some unused component list data
+                sint const diff =
+                        sint(m_list_value_ids.size())-
+                        this->m_scene.GetEntityList().size();
+
+                if(diff > 25) {
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_value_ids,
+                                          m_list_value_ids.size()-25);
+                }
+
+                this->template removeComponentFromEntityMask<ComponentType>(entity_id);
+
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsRemoved,Component::index,1);
+            }
+
+            void CreateCopies(Id src_entity_id,
+                              std::vector<Id> const &list_entity_ids)
+            {
+                if(list_entity_ids.empty() ||
+                   !(m_list_value_ids.size() > src_entity_id) ||
+                   m_list_value_ids[src_entity_id] == invalid_value_id) {
+                    return;
+                }
+
+                KS_ECS_PROFILE_COMPONENT_COUNT(ComponentsCreated,Component::index,
+                                               list_entity_ids.size());
+
+                Id const max_entity_id =
+                        *std::max_element(list_entity_ids.begin(),
+                                          list_entity_ids.end());
+
+                if(!(m_list_value_ids.size() > max_entity_id)) {
+                    KS_ECS_PROFILE_RESIZE(Component::index,m_list_value_ids,
+                                          max_entity_id+25,invalid_value_id);
+                }
+
+                // Copies only need another reference to the value.
+                // Take the new references before releasing the old
+                // ones in case they're the same value
+                Id const value_id = m_list_value_ids[src_entity_id];
+                m_list_values.Get(value_id).ref_count += list_entity_ids.size();
+
+                for(auto const entity_id : list_entity_ids) {
+                    releaseValue(m_list_value_ids[entity_id]);
+                    m_list_value_ids[entity_id] = value_id;
+                }
+            }
+
+            ComponentType const & GetComponent(Id entity_id) const
+            {
+                return m_list_values.GetList()[m_list_value_ids[entity_id]].value;
+            }
+
+            // Returns the id of the value the entity references;
+            // entities with the same value id share the same value
+            Id GetValueId(Id entity_id) const
+            {
+                return m_list_value_ids[entity_id];
+            }
+
+            uint GetRefCount(Id entity_id) const
+            {
+                return m_list_values.GetList()[m_list_value_ids[entity_id]].ref_count;
+            }
+
+            // Returns the number of distinct values being stored
+            uint GetValueCount() const
+            {
+                return m_lkup_value_ids.size();
+            }
+
+        private:
+            struct SharedValue
+            {
+                ComponentType value;
+                std::size_t hash;
+                uint ref_count;
+            };
+
+            void releaseValue(Id value_id)
+            {
+                if(value_id == invalid_value_id) {
+                    return;
+                }
+
+                auto& shared_value = m_list_values.Get(value_id);
+                shared_value.ref_count--;
+                if(shared_value.ref_count > 0) {
+                    return;
+                }
+
+                auto range = m_lkup_value_ids.equal_range(shared_value.hash);
+                for(auto it = range.first; it != range.second; ++it) {
+                    if(it->second == value_id) {
+                        m_lkup_value_ids.erase(it);
+                        break;
+                    }
+                }
+
+                // Reset the value so its resources are freed
+                // before the slot is recycled
+                shared_value.value = ComponentType();
+                m_list_values.Remove(value_id);
+            }
+
+            RecycleIndexList<SharedValue> m_list_values;
+            std::unordered_multimap<std::size_t,Id> m_lkup_value_ids;
+            std::vector<Id> m_list_value_ids; // sparse list
+        };
+
+        template<typename SceneKey,typename ComponentType,typename Hash>
+        Id const SharedComponentList<SceneKey,ComponentType,Hash>::invalid_value_id;
+
+        // ============================================================= //
+
     }
 }
 
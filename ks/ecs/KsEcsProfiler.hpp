@@ -0,0 +1,553 @@
+/*
+   Copyright (C) 2015 Preet Desai (preet.desai@gmail.com)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef KS_ECS_PROFILER_HPP
+#define KS_ECS_PROFILER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include <ks/KsGlobals.hpp>
+
+// Define KS_ECS_ENABLE_PROFILING to record scopes and counters
+// from ks::ecs and from any code that uses the macros below.
+// When it isn't defined the macros expand to nothing.
+//
+// Each thread records events into a ring buffer of
+// KS_ECS_PROFILE_BUFFER_SIZE events. When a thread records more
+// events than that between exports, the oldest ones are overwritten
+// so the buffer always holds the newest events
+#ifndef KS_ECS_PROFILE_BUFFER_SIZE
+#define KS_ECS_PROFILE_BUFFER_SIZE 16384
+#endif
+
+#ifdef KS_ECS_ENABLE_PROFILING
+    #define KS_ECS_PROFILE_SCOPE(scope,name) \
+        ks::ecs::ProfileScope scope(name)
+
+    #define KS_ECS_PROFILE_VISITED(scope,n) \
+        scope.AddVisited(n)
+
+    #define KS_ECS_PROFILE_MATCHED(scope,n) \
+        scope.AddMatched(n)
+
+    #define KS_ECS_PROFILE_COUNT(counter,n) \
+        ks::ecs::Profiler::AddCount(ks::ecs::Profiler::Counter::counter,n)
+
+    #define KS_ECS_PROFILE_COMPONENT_COUNT(counter,component_index,n) \
+        ks::ecs::Profiler::AddCount(ks::ecs::Profiler::Counter::counter,component_index,n)
+
+    // Resizes @list and counts a ListReallocations for
+    // @component_index if its storage was reallocated
+    #define KS_ECS_PROFILE_RESIZE(component_index,list,...) \
+        do { \
+            auto const ks_ecs_capacity = (list).capacity(); \
+            (list).resize(__VA_ARGS__); \
+            if((list).capacity() != ks_ecs_capacity) { \
+                KS_ECS_PROFILE_COMPONENT_COUNT(ListReallocations,component_index,1); \
+            } \
+        } while(0)
+#else
+    #define KS_ECS_PROFILE_SCOPE(scope,name)
+    #define KS_ECS_PROFILE_VISITED(scope,n) ((void)0)
+    #define KS_ECS_PROFILE_MATCHED(scope,n) ((void)0)
+    #define KS_ECS_PROFILE_COUNT(counter,n) ((void)0)
+    #define KS_ECS_PROFILE_COMPONENT_COUNT(counter,component_index,n) ((void)0)
+    #define KS_ECS_PROFILE_RESIZE(component_index,list,...) \
+        (list).resize(__VA_ARGS__)
+#endif
+
+namespace ks
+{
+    namespace ecs
+    {
+        // ============================================================= //
+
+        // Collects scope events and counters into per-thread buffers.
+        // Each thread only ever writes to its own buffer, so recording
+        // an event or counting doesn't take a lock or share a cache
+        // line with other threads.
+        // A thread takes the registry lock once to get a buffer, and
+        // again when it exits to return the buffer to a free pool.
+        // New threads reuse pooled buffers, so the number of buffers
+        // is bounded by the number of threads recording at once
+        class Profiler
+        {
+        public:
+            enum class Counter : uint
+            {
+                EntitiesCreated,
+                EntitiesRemoved,
+                ComponentsCreated,
+                ComponentsRemoved,
+                ListReallocations,
+                Count
+            };
+
+            // Counters are kept per component type index (ie.
+            // Scene::Component<T>::index) so a trace shows which
+            // component list is responsible. Counts that don't
+            // belong to a component list use no_component_index.
+            // Component lists of different SceneKeys that have the
+            // same index share a counter
+            static uint const no_component_index{64};
+            static uint const component_index_count{no_component_index+1};
+
+            struct Event
+            {
+                char const * name;
+                u64 start_ns;
+                u64 duration_ns;
+                uint visited;
+                uint matched;
+            };
+
+            static void AddCount(Counter counter, u64 n)
+            {
+                AddCount(counter,no_component_index,n);
+            }
+
+            static void AddCount(Counter counter, uint component_index, u64 n)
+            {
+                // Only this thread writes to its counters so
+                // there's no need for an atomic add
+                auto& count = getThreadBuffer().counters[uint(counter)][component_index];
+                count.store(count.load(std::memory_order_relaxed)+n,
+                            std::memory_order_relaxed);
+            }
+
+            // Returns the count summed over all component indices
+            static u64 GetCount(Counter counter)
+            {
+                std::lock_guard<std::mutex> lock(getMutex());
+
+                u64 count=0;
+                for(uint i=0; i < component_index_count; i++) {
+                    count += getCount(counter,i);
+                }
+
+                return count;
+            }
+
+            static u64 GetCount(Counter counter, uint component_index)
+            {
+                std::lock_guard<std::mutex> lock(getMutex());
+                return getCount(counter,component_index);
+            }
+
+            // Returns the time since the profiler epoch in nanoseconds
+            static u64 GetTimeNs()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now()-getEpoch()).count();
+            }
+
+            // @name must outlive the profiler (ie. a string literal)
+            static void Record(Event const &event)
+            {
+                auto& buffer = getThreadBuffer();
+
+                // Mark the slot as being written before writing it so
+                // an exporter reading the same slot can tell that it
+                // was overwritten (see readEvents)
+                u64 const index = buffer.started.load(std::memory_order_relaxed);
+                buffer.started.store(index+1,std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+
+                auto& slot = buffer.list_slots[index % buffer.list_slots.size()];
+                slot.name.store(event.name,std::memory_order_relaxed);
+                slot.start_ns.store(event.start_ns,std::memory_order_relaxed);
+                slot.duration_ns.store(event.duration_ns,std::memory_order_relaxed);
+                slot.visited.store(event.visited,std::memory_order_relaxed);
+                slot.matched.store(event.matched,std::memory_order_relaxed);
+
+                buffer.committed.store(index+1,std::memory_order_release);
+            }
+
+            // Returns the number of events that were overwritten
+            // before they could be exported
+            static u64 GetDroppedEventCount()
+            {
+                std::lock_guard<std::mutex> lock(getMutex());
+
+                u64 dropped=0;
+                for(auto const &buffer : getThreadBuffers()) {
+                    dropped += buffer->dropped;
+                }
+
+                return dropped;
+            }
+
+            static uint GetThreadBufferCount()
+            {
+                std::lock_guard<std::mutex> lock(getMutex());
+                return getThreadBuffers().size();
+            }
+
+            // Discards all events that haven't been exported yet
+            // and clears the counters. Can be called while other
+            // threads are recording
+            static void Reset()
+            {
+                std::lock_guard<std::mutex> lock(getMutex());
+
+                // The counters belong to their threads, so rather
+                // than clearing them, remember where they were
+                for(auto &buffer : getThreadBuffers()) {
+                    buffer->exported = buffer->committed.load(std::memory_order_acquire);
+                    buffer->dropped = 0;
+
+                    for(uint c=0; c < uint(Counter::Count); c++) {
+                        for(uint i=0; i < component_index_count; i++) {
+                            buffer->counters_reset[c][i] =
+                                    buffer->counters[c][i].load(std::memory_order_relaxed);
+                        }
+                    }
+                }
+            }
+
+            // Returns the events recorded since the last export and
+            // the current counter values in the Chrome trace event
+            // format, which can be loaded into chrome://tracing or
+            // Perfetto. Exported events are removed from the thread
+            // buffers. Can be called while other threads are recording
+            static std::string GetChromeTrace()
+            {
+                std::ostringstream ss;
+                ss << std::fixed << std::setprecision(3);
+                ss << "{\"traceEvents\":[";
+
+                bool first=true;
+                auto next = [&]() {
+                    if(!first) {
+                        ss << ",";
+                    }
+                    first = false;
+                    ss << "\n";
+                };
+
+                {
+                    std::lock_guard<std::mutex> lock(getMutex());
+
+                    std::vector<Event> list_events;
+                    for(auto const &buffer : getThreadBuffers()) {
+                        readEvents(*buffer,list_events);
+
+                        for(auto const &event : list_events) {
+                            next();
+                            ss << "{\"name\":\"";
+                            writeEscaped(ss,event.name);
+                            ss << "\",\"cat\":\"ecs\",\"ph\":\"X\""
+                               << ",\"pid\":0,\"tid\":" << buffer->thread_index
+                               << ",\"ts\":" << (event.start_ns/1000.0)
+                               << ",\"dur\":" << (event.duration_ns/1000.0)
+                               << ",\"args\":{\"visited\":" << event.visited
+                               << ",\"matched\":" << event.matched << "}}";
+                        }
+                    }
+                }
+
+                static std::array<char const *,uint(Counter::Count)> const list_counter_names{{
+                    "EntitiesCreated",
+                    "EntitiesRemoved",
+                    "ComponentsCreated",
+                    "ComponentsRemoved",
+                    "ListReallocations"
+                }};
+
+                // Each counter gets one series per component index
+                // that has a count
+                std::lock_guard<std::mutex> lock(getMutex());
+
+                double const ts = GetTimeNs()/1000.0;
+                for(uint c=0; c < list_counter_names.size(); c++) {
+                    next();
+                    ss << "{\"name\":\"" << list_counter_names[c] << "\""
+                       << ",\"cat\":\"ecs\",\"ph\":\"C\",\"pid\":0,\"tid\":0"
+                       << ",\"ts\":" << ts
+                       << ",\"args\":{";
+
+                    bool first_arg=true;
+                    for(uint i=0; i < component_index_count; i++) {
+                        u64 const count = getCount(Counter(c),i);
+                        if(count == 0) {
+                            continue;
+                        }
+
+                        if(!first_arg) {
+                            ss << ",";
+                        }
+                        first_arg = false;
+
+                        if(i == no_component_index) {
+                            ss << "\"scene\":" << count;
+                        }
+                        else {
+                            ss << "\"component " << i << "\":" << count;
+                        }
+                    }
+
+                    ss << "}}";
+                }
+
+                ss << "\n]}\n";
+
+                return ss.str();
+            }
+
+        private:
+            struct Slot
+            {
+                std::atomic<char const *> name;
+                std::atomic<u64> start_ns;
+                std::atomic<u64> duration_ns;
+                std::atomic<uint> visited;
+                std::atomic<uint> matched;
+            };
+
+            using CounterArray =
+                std::array<
+                    std::array<std::atomic<u64>,component_index_count>,
+                    uint(Counter::Count)
+                >;
+
+            using CounterResetArray =
+                std::array<
+                    std::array<u64,component_index_count>,
+                    uint(Counter::Count)
+                >;
+
+            // A ring buffer of events and the thread's counters.
+            // started, committed and counters are only written by
+            // the thread that owns the buffer; exported, dropped and
+            // counters_reset are only touched with the registry
+            // lock held
+            struct ThreadBuffer
+            {
+                ThreadBuffer(uint thread_index) :
+                    thread_index(thread_index),
+                    list_slots(KS_ECS_PROFILE_BUFFER_SIZE),
+                    started(0),
+                    committed(0),
+                    exported(0),
+                    dropped(0)
+                {
+                    for(uint c=0; c < uint(Counter::Count); c++) {
+                        for(uint i=0; i < component_index_count; i++) {
+                            counters[c][i].store(0,std::memory_order_relaxed);
+                            counters_reset[c][i] = 0;
+                        }
+                    }
+                }
+
+                uint const thread_index;
+                std::vector<Slot> list_slots;
+                std::atomic<u64> started;
+                std::atomic<u64> committed;
+                u64 exported;
+                u64 dropped;
+
+                CounterArray counters;
+                CounterResetArray counters_reset;
+            };
+
+            // Returns a thread's buffer to the pool when the thread exits
+            struct ThreadBufferHolder
+            {
+                ~ThreadBufferHolder()
+                {
+                    if(buffer) {
+                        std::lock_guard<std::mutex> lock(getMutex());
+                        getFreeThreadBuffers().push_back(buffer);
+                    }
+                }
+
+                ThreadBuffer* buffer{nullptr};
+            };
+
+            static std::chrono::steady_clock::time_point getEpoch()
+            {
+                static std::chrono::steady_clock::time_point const epoch =
+                        std::chrono::steady_clock::now();
+                return epoch;
+            }
+
+            // Must be called with the registry lock held
+            static u64 getCount(Counter counter, uint component_index)
+            {
+                u64 count=0;
+                for(auto const &buffer : getThreadBuffers()) {
+                    count += buffer->counters[uint(counter)][component_index].load(
+                                std::memory_order_relaxed) -
+                             buffer->counters_reset[uint(counter)][component_index];
+                }
+
+                return count;
+            }
+
+            static std::mutex& getMutex()
+            {
+                static std::mutex mutex;
+                return mutex;
+            }
+
+            static std::vector<unique_ptr<ThreadBuffer>>& getThreadBuffers()
+            {
+                static std::vector<unique_ptr<ThreadBuffer>> list_buffers;
+                return list_buffers;
+            }
+
+            static std::vector<ThreadBuffer*>& getFreeThreadBuffers()
+            {
+                static std::vector<ThreadBuffer*> list_free_buffers;
+                return list_free_buffers;
+            }
+
+            static ThreadBuffer& getThreadBuffer()
+            {
+                thread_local ThreadBufferHolder holder;
+                if(holder.buffer == nullptr) {
+                    std::lock_guard<std::mutex> lock(getMutex());
+
+                    // Unexported events in a pooled buffer are kept;
+                    // the new thread just appends to them
+                    auto& list_free_buffers = getFreeThreadBuffers();
+                    if(!list_free_buffers.empty()) {
+                        holder.buffer = list_free_buffers.back();
+                        list_free_buffers.pop_back();
+                    }
+                    else {
+                        auto& list_buffers = getThreadBuffers();
+                        list_buffers.push_back(
+                                    make_unique<ThreadBuffer>(list_buffers.size()));
+                        holder.buffer = list_buffers.back().get();
+                    }
+                }
+
+                return *(holder.buffer);
+            }
+
+            // Moves the events that haven't been exported yet into
+            // @list_events. Must be called with the registry lock held
+            static void readEvents(ThreadBuffer &buffer,
+                                   std::vector<Event> &list_events)
+            {
+                list_events.clear();
+
+                u64 const size = buffer.list_slots.size();
+                u64 const committed = buffer.committed.load(std::memory_order_acquire);
+                u64 const begin =
+                        std::max(buffer.exported,(committed > size) ? committed-size : 0);
+
+                for(u64 i=begin; i < committed; i++) {
+                    auto const &slot = buffer.list_slots[i % size];
+
+                    Event event;
+                    event.name = slot.name.load(std::memory_order_relaxed);
+                    event.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+                    event.duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+                    event.visited = slot.visited.load(std::memory_order_relaxed);
+                    event.matched = slot.matched.load(std::memory_order_relaxed);
+                    list_events.push_back(event);
+                }
+
+                // The owning thread may have wrapped around and started
+                // overwriting slots while they were being read. Event i
+                // is only intact if event i+size hadn't been started
+                std::atomic_thread_fence(std::memory_order_acquire);
+                u64 const started = buffer.started.load(std::memory_order_relaxed);
+                u64 const valid_begin =
+                        std::min(committed,
+                                 std::max(begin,(started > size) ? started-size : 0));
+
+                list_events.erase(list_events.begin(),
+                                  list_events.begin()+(valid_begin-begin));
+
+                buffer.dropped += valid_begin-buffer.exported;
+                buffer.exported = committed;
+            }
+
+            static void writeEscaped(std::ostringstream &ss, char const *str)
+            {
+                for(; *str != '\0'; str++) {
+                    char const c = *str;
+                    if(c == '"' || c == '\\') {
+                        ss << '\\' << c;
+                    }
+                    else if(u8(c) < 0x20) {
+                        ss << ' ';
+                    }
+                    else {
+                        ss << c;
+                    }
+                }
+            }
+        };
+
+        // ============================================================= //
+
+        // Times the enclosing scope and records it along with
+        // the number of entities visited and matched
+        class ProfileScope
+        {
+        public:
+            ProfileScope(char const *name) :
+                m_name(name),
+                m_start_ns(Profiler::GetTimeNs()),
+                m_visited(0),
+                m_matched(0)
+            {}
+
+            ~ProfileScope()
+            {
+                Profiler::Event event;
+                event.name = m_name;
+                event.start_ns = m_start_ns;
+                event.duration_ns = Profiler::GetTimeNs()-m_start_ns;
+                event.visited = m_visited;
+                event.matched = m_matched;
+
+                Profiler::Record(event);
+            }
+
+            void AddVisited(uint n)
+            {
+                m_visited += n;
+            }
+
+            void AddMatched(uint n)
+            {
+                m_matched += n;
+            }
+
+        private:
+            char const * const m_name;
+            u64 const m_start_ns;
+            uint m_visited;
+            uint m_matched;
+        };
+
+        // ============================================================= //
+    }
+}
+
+#endif // KS_ECS_PROFILER_HPP
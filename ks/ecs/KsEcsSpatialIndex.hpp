@@ -0,0 +1,595 @@
+/*
+   Copyright (C) 2015 Preet Desai (preet.desai@gmail.com)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef KS_ECS_SPATIAL_INDEX_HPP
+#define KS_ECS_SPATIAL_INDEX_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+#include <ks/ecs/KsEcs.hpp>
+
+namespace ks
+{
+    namespace ecs
+    {
+        // ============================================================= //
+
+        // Reads the position out of a component. The default
+        // expects x,y,z members; specialize this for position
+        // components that are laid out differently
+        template<typename ComponentType>
+        struct SpatialPosition
+        {
+            static std::array<float,3> Get(ComponentType const &cm)
+            {
+                return {{ float(cm.x), float(cm.y), float(cm.z) }};
+            }
+        };
+
+        // ============================================================= //
+
+        // A uniform grid of entity ids keyed by position. Entities
+        // are bucketed into cubic cells of cell_size; queries only
+        // visit the cells that overlap the query volume. Inserting
+        // an entity that is already in the index moves it. Cell
+        // coordinates are clamped to +/- 2^30, so positions further
+        // out than that (in units of cell_size) share edge cells
+        class SpatialIndex
+        {
+        public:
+            using Vec3 = std::array<float,3>;
+
+            SpatialIndex(float cell_size) :
+                m_cell_size(cell_size),
+                m_inv_cell_size(1.0f/cell_size),
+                m_size(0)
+            {}
+
+            ~SpatialIndex() = default;
+
+            void Insert(Id entity_id, Vec3 const &position)
+            {
+                if(!(m_list_entries.size() > entity_id)) {
+                    KS_ECS_PROFILE_RESIZE(Profiler::no_component_index,
+                                          m_list_entries,entity_id+25);
+                }
+
+                CellKey const key = getCellKey(position);
+                auto& entry = m_list_entries[entity_id];
+
+                if(entry.valid) {
+                    if(entry.cell == key) {
+                        // Still in the same cell, nothing to rebucket
+                        entry.position = position;
+                        return;
+                    }
+                    removeFromCell(entity_id);
+                }
+                else {
+                    m_size++;
+                }
+
+                auto it = m_lkup_cells.find(key);
+                if(it == m_lkup_cells.end()) {
+                    it = m_lkup_cells.emplace(key,m_list_cells.size()).first;
+                    m_list_cells.emplace_back();
+                    m_list_cells.back().key = key;
+                }
+
+                auto& cell = m_list_cells[it->second].list_ids;
+                entry.valid = true;
+                entry.position = position;
+                entry.cell = key;
+                entry.slot = cell.size();
+                cell.push_back(entity_id);
+            }
+
+            void Remove(Id entity_id)
+            {
+                if(!Contains(entity_id)) {
+                    return;
+                }
+
+                removeFromCell(entity_id);
+                m_list_entries[entity_id].valid = false;
+                m_size--;
+            }
+
+            bool Contains(Id entity_id) const
+            {
+                return ((m_list_entries.size() > entity_id) &&
+                        m_list_entries[entity_id].valid);
+            }
+
+            uint GetSize() const
+            {
+                return m_size;
+            }
+
+            float GetCellSize() const
+            {
+                return m_cell_size;
+            }
+
+            // Returns the number of occupied cells. Cells are
+            // numbered [0,GetCellCount()) for GetBroadphasePairs
+            uint GetCellCount() const
+            {
+                return m_list_cells.size();
+            }
+
+            std::vector<Id> GetEntitiesInAABB(Vec3 const &min,
+                                              Vec3 const &max) const
+            {
+                KS_ECS_PROFILE_SCOPE(scope,"ecs::SpatialIndex::GetEntitiesInAABB");
+
+                std::vector<Id> list_ids;
+                forEachCellInRange(
+                            getCellKey(min),
+                            getCellKey(max),
+                            [&](std::vector<Id> const &cell) {
+                                KS_ECS_PROFILE_VISITED(scope,cell.size());
+                                for(auto const id : cell) {
+                                    auto const &p = m_list_entries[id].position;
+                                    if(p[0] >= min[0] && p[0] <= max[0] &&
+                                       p[1] >= min[1] && p[1] <= max[1] &&
+                                       p[2] >= min[2] && p[2] <= max[2]) {
+                                        list_ids.push_back(id);
+                                    }
+                                }
+                            });
+
+                KS_ECS_PROFILE_MATCHED(scope,list_ids.size());
+
+                return list_ids;
+            }
+
+            std::vector<Id> GetEntitiesInRadius(Vec3 const &center,
+                                                float radius) const
+            {
+                Vec3 const min{{center[0]-radius,center[1]-radius,center[2]-radius}};
+                Vec3 const max{{center[0]+radius,center[1]+radius,center[2]+radius}};
+                float const radius2 = radius*radius;
+
+                KS_ECS_PROFILE_SCOPE(scope,"ecs::SpatialIndex::GetEntitiesInRadius");
+
+                std::vector<Id> list_ids;
+                forEachCellInRange(
+                            getCellKey(min),
+                            getCellKey(max),
+                            [&](std::vector<Id> const &cell) {
+                                KS_ECS_PROFILE_VISITED(scope,cell.size());
+                                for(auto const id : cell) {
+                                    if(getDistance2(center,id) <= radius2) {
+                                        list_ids.push_back(id);
+                                    }
+                                }
+                            });
+
+                KS_ECS_PROFILE_MATCHED(scope,list_ids.size());
+
+                return list_ids;
+            }
+
+            // Returns the ids of the k entities closest to center,
+            // nearest first
+            std::vector<Id> GetKNearestEntities(Vec3 const &center,
+                                                uint k) const
+            {
+                k = std::min(k,m_size);
+                if(k == 0) {
+                    return {};
+                }
+
+                KS_ECS_PROFILE_SCOPE(scope,"ecs::SpatialIndex::GetKNearestEntities");
+
+                std::vector<std::pair<float,Id>> list_candidates;
+                auto add_cell = [&](std::vector<Id> const &cell) {
+                    for(auto const id : cell) {
+                        list_candidates.emplace_back(getDistance2(center,id),id);
+                    }
+                };
+
+                // Search shells of cells around the center cell. Anything
+                // outside shell r is at least r*cell_size away, so once the
+                // kth candidate is closer than that the search is done
+                CellKey const c = getCellKey(center);
+                for(sint r=0; ; r++) {
+                    u64 const shell_width = 2*u64(r)+1;
+                    if(shell_width*shell_width*shell_width > m_list_cells.size()) {
+                        // The shells have grown larger than the number
+                        // of occupied cells; just check every cell
+                        list_candidates.clear();
+                        for(auto const &cell : m_list_cells) {
+                            add_cell(cell.list_ids);
+                        }
+                        break;
+                    }
+
+                    for(sint dx=-r; dx <= r; dx++) {
+                        for(sint dy=-r; dy <= r; dy++) {
+                            bool const on_face = (std::abs(dx)==r || std::abs(dy)==r);
+                            sint const dz_step = (on_face || r==0) ? 1 : 2*r;
+                            for(sint dz=-r; dz <= r; dz += dz_step) {
+                                auto it = m_lkup_cells.find(CellKey{c.x+dx,c.y+dy,c.z+dz});
+                                if(it != m_lkup_cells.end()) {
+                                    add_cell(m_list_cells[it->second].list_ids);
+                                }
+                            }
+                        }
+                    }
+
+                    if(list_candidates.size() >= k) {
+                        std::nth_element(list_candidates.begin(),
+                                         list_candidates.begin()+(k-1),
+                                         list_candidates.end());
+
+                        float const shell_dist = r*m_cell_size;
+                        if(list_candidates[k-1].first <= shell_dist*shell_dist) {
+                            break;
+                        }
+                    }
+                }
+
+                std::partial_sort(list_candidates.begin(),
+                                  list_candidates.begin()+k,
+                                  list_candidates.end());
+
+                std::vector<Id> list_ids;
+                list_ids.reserve(k);
+                for(uint i=0; i < k; i++) {
+                    list_ids.push_back(list_candidates[i].second);
+                }
+
+                KS_ECS_PROFILE_VISITED(scope,list_candidates.size());
+                KS_ECS_PROFILE_MATCHED(scope,k);
+
+                return list_ids;
+            }
+
+            // Returns every pair of entities that are within distance
+            // of each other, with the lower id first
+            std::vector<std::pair<Id,Id>> GetBroadphasePairs(float distance) const
+            {
+                std::vector<std::pair<Id,Id>> list_pairs;
+                GetBroadphasePairs(distance,0,GetCellCount(),list_pairs);
+
+                return list_pairs;
+            }
+
+            // Appends the pairs of entities within distance of each
+            // other to @list_pairs, for the pairs whose first cell is
+            // in [@begin_cell,@end_cell). Calls with disjoint cell
+            // ranges can run in parallel (ie. split GetCellCount()
+            // across a job system) as long as the index isn't being
+            // modified. Together they return every pair once. The
+            // number of neighbouring cells checked grows with
+            // distance/cell_size, so distance should be on the order
+            // of the cell size
+            void GetBroadphasePairs(float distance,
+                                    uint begin_cell,
+                                    uint end_cell,
+                                    std::vector<std::pair<Id,Id>> &list_pairs) const
+            {
+                end_cell = std::min(end_cell,GetCellCount());
+                if(!(begin_cell < end_cell)) {
+                    return;
+                }
+
+                KS_ECS_PROFILE_SCOPE(scope,"ecs::SpatialIndex::GetBroadphasePairs");
+
+                auto const pair_count = list_pairs.size();
+
+                float const distance2 = distance*distance;
+                auto add_pair = [&](Id a, Id b) {
+                    if(getDistance2(m_list_entries[a].position,b) <= distance2) {
+                        list_pairs.push_back((a < b) ?
+                                                 std::make_pair(a,b) :
+                                                 std::make_pair(b,a));
+                    }
+                };
+
+                auto add_cell_pairs = [&](std::vector<Id> const &cell_a,
+                                          std::vector<Id> const &cell_b) {
+                    for(auto const a : cell_a) {
+                        for(auto const b : cell_b) {
+                            add_pair(a,b);
+                        }
+                    }
+                };
+
+                // Only look at the 'forward' half of the neighbouring
+                // cells so that each pair of cells is visited once
+                float const n_f =
+                        std::max(1.0f,std::ceil(distance*m_inv_cell_size));
+
+                bool const check_all_cells =
+                        !(n_f < 1024.0f) ||
+                        ((2*u64(n_f)+1)*(2*u64(n_f)+1)*(2*u64(n_f)+1)/2 >
+                         m_list_cells.size());
+
+                std::vector<CellKey> list_offsets;
+                if(!check_all_cells) {
+                    sint const n = sint(n_f);
+                    for(sint dx=-n; dx <= n; dx++) {
+                        for(sint dy=-n; dy <= n; dy++) {
+                            for(sint dz=-n; dz <= n; dz++) {
+                                if(dx > 0 || (dx == 0 && (dy > 0 || (dy == 0 && dz > 0)))) {
+                                    list_offsets.push_back(CellKey{dx,dy,dz});
+                                }
+                            }
+                        }
+                    }
+                }
+
+                for(uint i=begin_cell; i < end_cell; i++) {
+                    CellKey const &key = m_list_cells[i].key;
+                    auto const &cell = m_list_cells[i].list_ids;
+
+                    KS_ECS_PROFILE_VISITED(scope,cell.size());
+
+                    for(uint a=0; a < cell.size(); a++) {
+                        for(uint b=a+1; b < cell.size(); b++) {
+                            add_pair(cell[a],cell[b]);
+                        }
+                    }
+
+                    if(check_all_cells) {
+                        // The neighbourhood covers more cells than are
+                        // occupied, so pair this cell with every cell
+                        // after it instead
+                        for(uint j=i+1; j < m_list_cells.size(); j++) {
+                            add_cell_pairs(cell,m_list_cells[j].list_ids);
+                        }
+                        continue;
+                    }
+
+                    for(auto const &offset : list_offsets) {
+                        auto it = m_lkup_cells.find(
+                                    CellKey{key.x+offset.x,
+                                            key.y+offset.y,
+                                            key.z+offset.z});
+
+                        if(it != m_lkup_cells.end()) {
+                            add_cell_pairs(cell,m_list_cells[it->second].list_ids);
+                        }
+                    }
+                }
+
+                KS_ECS_PROFILE_MATCHED(scope,list_pairs.size()-pair_count);
+            }
+
+        private:
+            struct CellKey
+            {
+                sint x;
+                sint y;
+                sint z;
+
+                bool operator == (CellKey const &other) const
+                {
+                    return (x == other.x && y == other.y && z == other.z);
+                }
+            };
+
+            struct CellKeyHash
+            {
+                std::size_t operator()(CellKey const &key) const
+                {
+                    // Large primes from Teschner et al. 2003,
+                    // "Optimized Spatial Hashing for Collision
+                    // Detection of Deformable Objects"
+                    return std::size_t((u64(u32(key.x))*73856093) ^
+                                       (u64(u32(key.y))*19349663) ^
+                                       (u64(u32(key.z))*83492791));
+                }
+            };
+
+            struct Cell
+            {
+                CellKey key;
+                std::vector<Id> list_ids;
+            };
+
+            struct Entry
+            {
+                bool valid{false};
+                Vec3 position;
+                CellKey cell;
+                uint slot; // index into the cell's id list
+            };
+
+            // Keep cell coordinates well inside the range of sint so
+            // that neighbour offsets and range widths can't overflow
+            static sint const max_cell_coord{1 << 30};
+
+            sint getCellCoord(float x) const
+            {
+                float const c = std::floor(x*m_inv_cell_size);
+                if(!(c > float(-max_cell_coord))) { // also catches NaN
+                    return -max_cell_coord;
+                }
+                if(!(c < float(max_cell_coord))) {
+                    return max_cell_coord;
+                }
+                return sint(c);
+            }
+
+            CellKey getCellKey(Vec3 const &position) const
+            {
+                return CellKey{
+                    getCellCoord(position[0]),
+                    getCellCoord(position[1]),
+                    getCellCoord(position[2])
+                };
+            }
+
+            float getDistance2(Vec3 const &position, Id entity_id) const
+            {
+                auto const &p = m_list_entries[entity_id].position;
+                float const dx = p[0]-position[0];
+                float const dy = p[1]-position[1];
+                float const dz = p[2]-position[2];
+                return (dx*dx + dy*dy + dz*dz);
+            }
+
+            void removeFromCell(Id entity_id)
+            {
+                auto const &entry = m_list_entries[entity_id];
+                auto it = m_lkup_cells.find(entry.cell);
+                uint const cell_idx = it->second;
+                auto& cell = m_list_cells[cell_idx].list_ids;
+
+                // Swap with the last id in the cell and pop
+                Id const last_id = cell.back();
+                cell[entry.slot] = last_id;
+                m_list_entries[last_id].slot = entry.slot;
+                cell.pop_back();
+
+                if(cell.empty()) {
+                    // Swap with the last cell and pop
+                    m_lkup_cells.erase(it);
+                    if(cell_idx+1 < m_list_cells.size()) {
+                        m_list_cells[cell_idx] = std::move(m_list_cells.back());
+                        m_lkup_cells[m_list_cells[cell_idx].key] = cell_idx;
+                    }
+                    m_list_cells.pop_back();
+                }
+            }
+
+            template<typename Fn>
+            void forEachCellInRange(CellKey const &min,
+                                    CellKey const &max,
+                                    Fn fn) const
+            {
+                if(min.x > max.x || min.y > max.y || min.z > max.z) {
+                    return;
+                }
+
+                // The widths can be up to 2^31 cells, so count the
+                // cells in range as a double to avoid overflow
+                double const range_count =
+                        (double(max.x)-double(min.x)+1.0)*
+                        (double(max.y)-double(min.y)+1.0)*
+                        (double(max.z)-double(min.z)+1.0);
+
+                if(range_count > m_list_cells.size()) {
+                    // Fewer occupied cells than cells in range,
+                    // so walk the occupied cells instead
+                    for(auto const &cell : m_list_cells) {
+                        auto const &k = cell.key;
+                        if(k.x >= min.x && k.x <= max.x &&
+                           k.y >= min.y && k.y <= max.y &&
+                           k.z >= min.z && k.z <= max.z) {
+                            fn(cell.list_ids);
+                        }
+                    }
+                    return;
+                }
+
+                for(sint x=min.x; x <= max.x; x++) {
+                    for(sint y=min.y; y <= max.y; y++) {
+                        for(sint z=min.z; z <= max.z; z++) {
+                            auto it = m_lkup_cells.find(CellKey{x,y,z});
+                            if(it != m_lkup_cells.end()) {
+                                fn(m_list_cells[it->second].list_ids);
+                            }
+                        }
+                    }
+                }
+            }
+
+            float const m_cell_size;
+            float const m_inv_cell_size;
+            uint m_size;
+
+            std::vector<Entry> m_list_entries; // sparse list
+            std::vector<Cell> m_list_cells; // occupied cells
+            std::unordered_map<CellKey,uint,CellKeyHash> m_lkup_cells;
+        };
+
+        // ============================================================= //
+
+        // A ComponentList for a position component that keeps a
+        // SpatialIndex in sync with its components. The index is
+        // updated on Create, CreateCopies, Remove and Modify.
+        //
+        // NOTE: Writing to a component through the mutable
+        // GetComponent or GetSparseList bypasses the index and
+        // leaves it stale; use Modify instead, or call Update
+        // after writing
+        template<typename SceneKey,
+                 typename ComponentType,
+                 typename PositionType=SpatialPosition<ComponentType>>
+        class SpatialComponentList : public ComponentList<SceneKey,ComponentType>
+        {
+            using base_type = ComponentList<SceneKey,ComponentType>;
+
+        public:
+            SpatialComponentList(Scene<SceneKey> &scene, float cell_size) :
+                base_type(scene),
+                m_spatial_index(cell_size)
+            {}
+
+            ~SpatialComponentList() = default;
+
+            void Remove(Id entity_id)
+            {
+                base_type::Remove(entity_id);
+                m_spatial_index.Remove(entity_id);
+            }
+
+            // Calls @fn with the entity's component so it can be
+            // changed, then moves the entity in the index
+            template<typename Fn>
+            ComponentType& Modify(Id entity_id, Fn fn)
+            {
+                auto& cm = this->GetComponent(entity_id);
+                fn(cm);
+                Update(entity_id);
+
+                return cm;
+            }
+
+            void Update(Id entity_id)
+            {
+                m_spatial_index.Insert(
+                            entity_id,
+                            PositionType::Get(this->GetComponent(entity_id)));
+            }
+
+            SpatialIndex const & GetSpatialIndex() const
+            {
+                return m_spatial_index;
+            }
+
+        protected:
+            void onCreated(Id entity_id)
+            {
+                Update(entity_id);
+            }
+
+        private:
+            SpatialIndex m_spatial_index;
+        };
+
+        // ============================================================= //
+    }
+}
+
+#endif // KS_ECS_SPATIAL_INDEX_HPP
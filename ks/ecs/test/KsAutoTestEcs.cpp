@@ -18,8 +18,11 @@
 #include <catch/catch.hpp>
 
 #include <random>
+#include <thread>
 
 #include <ks/ecs/KsEcs.hpp>
+#include <ks/ecs/KsEcsSpatialIndex.hpp>
+#include <ks/ecs/KsEcsProfiler.hpp>
 
 // ============================================================= //
 
@@ -36,6 +39,12 @@ namespace ks_test_ecs {
     template<typename ComponentType>
     using ComponentList = ecs::ComponentList<SceneKey,ComponentType>;
 
+    template<typename ComponentType,typename Hash>
+    using SharedComponentList = ecs::SharedComponentList<SceneKey,ComponentType,Hash>;
+
+    template<typename ComponentType>
+    using SpatialComponentList = ecs::SpatialComponentList<SceneKey,ComponentType>;
+
     // NOTE:
     // Function local types and types in anonymous namespaces
     // for ecs::Component act funny in Clang, so avoid them!
@@ -82,6 +91,51 @@ namespace ks_test_ecs {
         int y;
         int z;
     };
+
+    struct DataBlob
+    {
+        DataBlob() {}
+
+        DataBlob(std::string name,uint size) :
+            name(name),data(size,0) {}
+
+        bool operator == (DataBlob const &other) const
+        {
+            return (name == other.name && data == other.data);
+        }
+
+        std::string name;
+        std::vector<u8> data;
+    };
+
+    // A list that doesn't implement CreateCopies, like
+    // lists written before Scene::Instantiate existed
+    template<typename ComponentType>
+    class MaskOnlyList : public ecs::ComponentListBase<SceneKey>
+    {
+    public:
+        MaskOnlyList(Scene &scene) :
+            ecs::ComponentListBase<SceneKey>(scene)
+        {}
+
+        void Create(Id entity_id)
+        {
+            this->template addComponentToEntityMask<ComponentType>(entity_id);
+        }
+
+        void Remove(Id entity_id)
+        {
+            this->template removeComponentFromEntityMask<ComponentType>(entity_id);
+        }
+    };
+
+    struct DataBlobHash
+    {
+        std::size_t operator()(DataBlob const &blob) const
+        {
+            return std::hash<std::string>()(blob.name);
+        }
+    };
 }
 
 using namespace ks_test_ecs;
@@ -320,3 +374,548 @@ TEST_CASE("Components","[ecs_components]")
     REQUIRE((scene->GetEntityList()[e1].mask) ==
             (Scene::GetComponentMask<DataABC,DataXYZ>()));
 }
+
+TEST_CASE("Spatial index","[ecs_spatial_index]")
+{
+    // Create scene
+    shared_ptr<EventLoop> evl = make_shared<EventLoop>();
+    shared_ptr<Scene> scene = MakeObject<Scene>(evl);
+
+    // Create a ComponentList that indexes DataXYZ by position
+    scene->RegisterComponentList<DataXYZ>(
+                make_unique<SpatialComponentList<DataXYZ>>(*scene,10.0f));
+
+    SpatialComponentList<DataXYZ>* cmlist_xyz =
+            static_cast<SpatialComponentList<DataXYZ>*>(
+                scene->GetComponentList<DataXYZ>());
+
+    auto const &index = cmlist_xyz->GetSpatialIndex();
+
+    // Create entities at random positions
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> dist(-100,100);
+
+    std::vector<Id> list_ents;
+    for(uint i=0; i < 500; i++) {
+        auto entity = scene->CreateEntity();
+        cmlist_xyz->Create(entity,DataXYZ(dist(rng),dist(rng),dist(rng)));
+        list_ents.push_back(entity);
+    }
+
+    REQUIRE(index.GetSize() == 500);
+
+    auto get_dist2 = [&](Id id, ecs::SpatialIndex::Vec3 const &p) {
+        auto const &cm = cmlist_xyz->GetComponent(id);
+        float const dx = cm.x-p[0];
+        float const dy = cm.y-p[1];
+        float const dz = cm.z-p[2];
+        return (dx*dx + dy*dy + dz*dz);
+    };
+
+    auto get_brute_force_radius = [&](ecs::SpatialIndex::Vec3 const &p, float r) {
+        std::set<Id> ids;
+        for(auto id : list_ents) {
+            if(get_dist2(id,p) <= r*r) {
+                ids.insert(id);
+            }
+        }
+        return ids;
+    };
+
+    auto to_set = [](std::vector<Id> const &list) {
+        return std::set<Id>(list.begin(),list.end());
+    };
+
+    // Radius
+    ecs::SpatialIndex::Vec3 const center{{5.0f,-3.0f,12.0f}};
+    REQUIRE(to_set(index.GetEntitiesInRadius(center,35.0f)) ==
+            get_brute_force_radius(center,35.0f));
+
+    // AABB
+    {
+        std::set<Id> ids;
+        for(auto id : list_ents) {
+            auto const &cm = cmlist_xyz->GetComponent(id);
+            if(cm.x >= -20 && cm.x <= 40 &&
+               cm.y >= 0 && cm.y <= 15 &&
+               cm.z >= -50 && cm.z <= 50) {
+                ids.insert(id);
+            }
+        }
+
+        REQUIRE(to_set(index.GetEntitiesInAABB({{-20,0,-50}},{{40,15,50}})) == ids);
+    }
+
+    // K nearest
+    {
+        auto list_nearest = index.GetKNearestEntities(center,10);
+        REQUIRE(list_nearest.size() == 10);
+
+        std::vector<float> list_dist2;
+        for(auto id : list_ents) {
+            list_dist2.push_back(get_dist2(id,center));
+        }
+        std::sort(list_dist2.begin(),list_dist2.end());
+
+        for(uint i=0; i < 10; i++) {
+            REQUIRE(get_dist2(list_nearest[i],center) == list_dist2[i]);
+        }
+
+        REQUIRE(index.GetKNearestEntities(center,1000).size() == 500);
+    }
+
+    // Broadphase pairs
+    {
+        std::set<std::pair<Id,Id>> pairs;
+        for(uint i=0; i < list_ents.size(); i++) {
+            auto const &cm = cmlist_xyz->GetComponent(list_ents[i]);
+            ecs::SpatialIndex::Vec3 const p{{float(cm.x),float(cm.y),float(cm.z)}};
+            for(uint j=i+1; j < list_ents.size(); j++) {
+                if(get_dist2(list_ents[j],p) <= 8.0f*8.0f) {
+                    pairs.emplace(std::min(list_ents[i],list_ents[j]),
+                                  std::max(list_ents[i],list_ents[j]));
+                }
+            }
+        }
+
+        auto list_pairs_st = index.GetBroadphasePairs(8.0f);
+        REQUIRE(list_pairs_st.size() == pairs.size());
+        REQUIRE(std::set<std::pair<Id,Id>>(
+                    list_pairs_st.begin(),list_pairs_st.end()) == pairs);
+
+        // Split the cells across threads
+        uint const thread_count = 4;
+        uint const cell_count = index.GetCellCount();
+        uint const cells_per_thread = (cell_count+thread_count-1)/thread_count;
+
+        std::vector<std::vector<std::pair<Id,Id>>> list_thread_pairs(thread_count);
+        std::vector<std::thread> list_threads;
+        for(uint t=0; t < thread_count; t++) {
+            list_threads.emplace_back([&,t]() {
+                index.GetBroadphasePairs(8.0f,
+                                         t*cells_per_thread,
+                                         (t+1)*cells_per_thread,
+                                         list_thread_pairs[t]);
+            });
+        }
+
+        std::vector<std::pair<Id,Id>> list_pairs_mt;
+        for(uint t=0; t < thread_count; t++) {
+            list_threads[t].join();
+            list_pairs_mt.insert(list_pairs_mt.end(),
+                                 list_thread_pairs[t].begin(),
+                                 list_thread_pairs[t].end());
+        }
+
+        REQUIRE(list_pairs_mt.size() == pairs.size());
+        REQUIRE(std::set<std::pair<Id,Id>>(
+                    list_pairs_mt.begin(),list_pairs_mt.end()) == pairs);
+
+        // Distances much larger than the cell size check every cell
+        REQUIRE(index.GetBroadphasePairs(1e10f).size() == 500*499/2);
+    }
+
+    // Queries that cover everything
+    {
+        float const inf = std::numeric_limits<float>::max();
+        REQUIRE(index.GetEntitiesInAABB({{-inf,-inf,-inf}},{{inf,inf,inf}}).size() == 500);
+        REQUIRE(index.GetEntitiesInRadius({{0,0,0}},3e9f).size() == 500);
+    }
+
+    // Update, Remove and RemoveEntity should keep the index in sync
+    auto e0 = list_ents[0];
+    auto e1 = list_ents[1];
+
+    cmlist_xyz->Modify(e0,[](DataXYZ &cm) { cm = DataXYZ(1000,1000,1000); });
+    REQUIRE(index.GetEntitiesInRadius({{1000,1000,1000}},1.0f) == std::vector<Id>{e0});
+    REQUIRE(index.GetKNearestEntities({{990,990,990}},1) == std::vector<Id>{e0});
+
+    cmlist_xyz->GetComponent(e0) = DataXYZ(2000,2000,2000);
+    cmlist_xyz->Update(e0);
+    REQUIRE(index.GetEntitiesInRadius({{2000,2000,2000}},1.0f) == std::vector<Id>{e0});
+
+    cmlist_xyz->Remove(e0);
+    REQUIRE(!index.Contains(e0));
+    REQUIRE(index.GetEntitiesInRadius({{1000,1000,1000}},1.0f).empty());
+
+    scene->RemoveEntity(e1);
+    REQUIRE(!index.Contains(e1));
+    REQUIRE(index.GetSize() == 498);
+
+    // Creating through a ComponentList pointer should still
+    // update the index
+    ComponentList<DataXYZ>* cmlist_xyz_base =
+            static_cast<ComponentList<DataXYZ>*>(
+                scene->GetComponentList<DataXYZ>());
+
+    auto e2 = scene->CreateEntity();
+    cmlist_xyz_base->Create(e2,DataXYZ(-1000,-1000,-1000));
+    REQUIRE(index.GetEntitiesInRadius({{-1000,-1000,-1000}},1.0f) == std::vector<Id>{e2});
+
+    cmlist_xyz_base->Remove(e2);
+    REQUIRE(!index.Contains(e2));
+
+    // Positions outside of the cell coordinate range
+    // share the edge cells
+    auto e3 = scene->CreateEntity();
+    auto e4 = scene->CreateEntity();
+    cmlist_xyz->Create(e3,DataXYZ(0,0,0));
+    cmlist_xyz->Modify(e3,[](DataXYZ &cm) { cm.x = std::numeric_limits<int>::max(); });
+    cmlist_xyz->Create(e4,DataXYZ(std::numeric_limits<int>::min(),0,0));
+
+    auto list_far = index.GetEntitiesInAABB({{1e9f,-1,-1}},{{1e20f,1,1}});
+    REQUIRE(list_far == std::vector<Id>{e3});
+    REQUIRE(index.GetKNearestEntities({{-3e9f,0,0}},1) == std::vector<Id>{e4});
+}
+
+TEST_CASE("Shared components","[ecs_shared_components]")
+{
+    // Create scene
+    shared_ptr<EventLoop> evl = make_shared<EventLoop>();
+    shared_ptr<Scene> scene = MakeObject<Scene>(evl);
+
+    // Create ComponentLists
+    scene->RegisterComponentList<DataBlob>(
+                make_unique<SharedComponentList<DataBlob,DataBlobHash>>(*scene));
+
+    SharedComponentList<DataBlob,DataBlobHash>* cmlist_blob =
+            static_cast<SharedComponentList<DataBlob,DataBlobHash>*>(
+                scene->GetComponentList<DataBlob>());
+
+    // Create entities that share values
+    auto e0 = scene->CreateEntity();
+    auto e1 = scene->CreateEntity();
+    auto e2 = scene->CreateEntity();
+
+    cmlist_blob->Create(e0,"a",1024);
+    cmlist_blob->Create(e1,DataBlob("a",1024));
+    cmlist_blob->Create(e2,"b",1024);
+
+    REQUIRE(cmlist_blob->GetValueCount() == 2);
+    REQUIRE(cmlist_blob->GetValueId(e0) == cmlist_blob->GetValueId(e1));
+    REQUIRE(cmlist_blob->GetValueId(e0) != cmlist_blob->GetValueId(e2));
+    REQUIRE(cmlist_blob->GetRefCount(e0) == 2);
+    REQUIRE(cmlist_blob->GetRefCount(e2) == 1);
+    REQUIRE(cmlist_blob->GetComponent(e1).name == "a");
+
+    REQUIRE((scene->GetEntityList()[e0].mask) ==
+            (Scene::GetComponentMask<DataBlob>()));
+
+    // Same name (and hash) but different data shouldn't be shared
+    auto e3 = scene->CreateEntity();
+    cmlist_blob->Create(e3,"a",16);
+    REQUIRE(cmlist_blob->GetValueCount() == 3);
+    REQUIRE(cmlist_blob->GetComponent(e3).data.size() == 16);
+    REQUIRE(cmlist_blob->GetComponent(e0).data.size() == 1024);
+
+    // Recreating with the same value keeps the reference
+    cmlist_blob->Create(e2,"b",1024);
+    REQUIRE(cmlist_blob->GetRefCount(e2) == 1);
+    REQUIRE(cmlist_blob->GetValueCount() == 3);
+
+    // Recreating with a different value moves the reference
+    cmlist_blob->Create(e3,"b",1024);
+    REQUIRE(cmlist_blob->GetValueCount() == 2);
+    REQUIRE(cmlist_blob->GetRefCount(e2) == 2);
+
+    // Values are released when the last reference is removed
+    cmlist_blob->Remove(e0);
+    REQUIRE(cmlist_blob->GetRefCount(e1) == 1);
+    REQUIRE(cmlist_blob->GetValueCount() == 2);
+    REQUIRE(scene->GetEntityList()[e0].mask == 0);
+
+    scene->RemoveEntity(e1);
+    REQUIRE(cmlist_blob->GetValueCount() == 1);
+
+    // Copying over an entity that already has a value
+    // should release the old value
+    auto e4 = scene->CreateEntity();
+    cmlist_blob->Create(e4,"c",64);
+    REQUIRE(cmlist_blob->GetValueCount() == 2);
+
+    cmlist_blob->CreateCopies(e2,std::vector<Id>{e4});
+    REQUIRE(cmlist_blob->GetValueCount() == 1);
+    REQUIRE(cmlist_blob->GetValueId(e4) == cmlist_blob->GetValueId(e2));
+    REQUIRE(cmlist_blob->GetRefCount(e2) == 3);
+
+    // Copying from an entity without a value does nothing
+    auto e5 = scene->CreateEntity();
+    cmlist_blob->CreateCopies(e5,std::vector<Id>{e4});
+    cmlist_blob->CreateCopies(1000,std::vector<Id>{e4});
+    REQUIRE(cmlist_blob->GetRefCount(e2) == 3);
+
+    // Values can be read through a const list
+    auto const &cmlist_blob_const = *cmlist_blob;
+    REQUIRE(cmlist_blob_const.GetComponent(e4).name == "b");
+    REQUIRE(cmlist_blob_const.GetRefCount(e4) == 3);
+}
+
+TEST_CASE("Prefabs","[ecs_prefabs]")
+{
+    // Create scene
+    shared_ptr<EventLoop> evl = make_shared<EventLoop>();
+    shared_ptr<Scene> scene = MakeObject<Scene>(evl);
+
+    // Create ComponentLists
+    scene->RegisterComponentList<DataABC>(
+                make_unique<ComponentList<DataABC>>(*scene));
+
+    scene->RegisterComponentList<DataXYZ>(
+                make_unique<SpatialComponentList<DataXYZ>>(*scene,10.0f));
+
+    scene->RegisterComponentList<DataBlob>(
+                make_unique<SharedComponentList<DataBlob,DataBlobHash>>(*scene));
+
+    ComponentList<DataABC>* cmlist_abc =
+            static_cast<ComponentList<DataABC>*>(
+                scene->GetComponentList<DataABC>());
+
+    SpatialComponentList<DataXYZ>* cmlist_xyz =
+            static_cast<SpatialComponentList<DataXYZ>*>(
+                scene->GetComponentList<DataXYZ>());
+
+    SharedComponentList<DataBlob,DataBlobHash>* cmlist_blob =
+            static_cast<SharedComponentList<DataBlob,DataBlobHash>*>(
+                scene->GetComponentList<DataBlob>());
+
+    // Create a prefab
+    auto prefab = scene->CreateEntity();
+    cmlist_abc->Create(prefab,DataABC(1,2,3));
+    cmlist_xyz->Create(prefab,DataXYZ(4,5,6));
+    cmlist_blob->Create(prefab,"material",4096);
+
+    // Instantiate it
+    auto list_ents = scene->Instantiate(prefab,100);
+    REQUIRE(list_ents.size() == 100);
+
+    auto const mask = Scene::GetComponentMask<DataABC,DataXYZ,DataBlob>();
+    for(auto entity : list_ents) {
+        REQUIRE(scene->GetEntityList()[entity].valid);
+        REQUIRE(scene->GetEntityList()[entity].mask == mask);
+        REQUIRE(cmlist_abc->GetComponent(entity).b == 2);
+        REQUIRE(cmlist_xyz->GetComponent(entity).z == 6);
+        REQUIRE(cmlist_blob->GetValueId(entity) == cmlist_blob->GetValueId(prefab));
+    }
+
+    REQUIRE(cmlist_blob->GetRefCount(prefab) == 101);
+    REQUIRE(cmlist_blob->GetValueCount() == 1);
+    REQUIRE(cmlist_xyz->GetSpatialIndex().GetEntitiesInRadius({{4,5,6}},0.5f).size() == 101);
+
+    // Instances are independent of the prefab
+    cmlist_abc->GetComponent(list_ents[0]).a = 11;
+    REQUIRE(cmlist_abc->GetComponent(prefab).a == 1);
+
+    scene->RemoveEntity(list_ents[1]);
+    REQUIRE(cmlist_blob->GetRefCount(prefab) == 100);
+    REQUIRE(cmlist_xyz->GetSpatialIndex().GetSize() == 100);
+
+    // Instantiating invalid or removed entities does nothing
+    auto const entity_count = scene->GetEntityIdList().size();
+    REQUIRE(scene->Instantiate(0,5).empty());
+    REQUIRE(scene->Instantiate(list_ents[1],5).empty());
+    REQUIRE(scene->Instantiate(100000,5).empty());
+    REQUIRE(scene->GetEntityIdList().size() == entity_count);
+
+    // Instantiating a prefab with a list that doesn't support
+    // it throws and doesn't create anything
+    scene->RegisterComponentList<SomeType1>(
+                make_unique<MaskOnlyList<SomeType1>>(*scene));
+
+    auto const cm_count = cmlist_xyz->GetSpatialIndex().GetSize();
+    auto const ref_count = cmlist_blob->GetRefCount(prefab);
+
+    static_cast<MaskOnlyList<SomeType1>*>(
+                scene->GetComponentList<SomeType1>())->Create(prefab);
+
+    REQUIRE_THROWS_AS(scene->Instantiate(prefab,5),ecs::InstantiateNotSupported);
+    REQUIRE(scene->GetEntityIdList().size() == entity_count);
+    REQUIRE(cmlist_xyz->GetSpatialIndex().GetSize() == cm_count);
+    REQUIRE(cmlist_blob->GetRefCount(prefab) == ref_count);
+
+    // Instantiating an entity without components
+    auto empty = scene->CreateEntity();
+    auto list_empty = scene->Instantiate(empty,3);
+    REQUIRE(list_empty.size() == 3);
+    REQUIRE(scene->GetEntityList()[list_empty[0]].mask == 0);
+}
+
+TEST_CASE("Profiler","[ecs_profiler]")
+{
+    using Profiler = ecs::Profiler;
+
+    Profiler::Reset();
+
+    // Record scopes from several threads
+    auto run_system = [](uint count) {
+        for(uint i=0; i < count; i++) {
+            ecs::ProfileScope scope("system \"quoted\"");
+            scope.AddVisited(10);
+            scope.AddMatched(4);
+        }
+    };
+
+    std::vector<std::thread> list_threads;
+    for(uint i=0; i < 3; i++) {
+        list_threads.emplace_back(run_system,5);
+    }
+    run_system(2);
+
+    for(auto &thread : list_threads) {
+        thread.join();
+    }
+
+    // Counts from several threads and component indices are summed
+    Profiler::AddCount(Profiler::Counter::ListReallocations,3);
+    Profiler::AddCount(Profiler::Counter::ListReallocations,5,2);
+    std::thread([]() {
+        Profiler::AddCount(Profiler::Counter::ListReallocations,5,4);
+    }).join();
+
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations) == 9);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations,5) == 6);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations,
+                               Profiler::no_component_index) == 3);
+    REQUIRE(Profiler::GetDroppedEventCount() == 0);
+
+    std::string const trace = Profiler::GetChromeTrace();
+    REQUIRE(trace.find("{\"traceEvents\":[") == 0);
+
+    auto count_substr = [&](std::string const &substr) {
+        uint count=0;
+        for(auto pos = trace.find(substr);
+            pos != std::string::npos;
+            pos = trace.find(substr,pos+1)) {
+            count++;
+        }
+        return count;
+    };
+
+    REQUIRE(count_substr("\"name\":\"system \\\"quoted\\\"\"") == 17);
+    REQUIRE(count_substr("\"args\":{\"visited\":10,\"matched\":4}") == 17);
+    REQUIRE(count_substr("\"name\":\"ListReallocations\",\"cat\":\"ecs\",\"ph\":\"C\"") == 1);
+    REQUIRE(count_substr("\"args\":{\"component 5\":6,\"scene\":3}") == 1);
+
+    Profiler::Reset();
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations) == 0);
+
+#ifdef KS_ECS_ENABLE_PROFILING
+    // Structural changes made through the scene are counted
+    shared_ptr<EventLoop> evl = make_shared<EventLoop>();
+    shared_ptr<Scene> scene = MakeObject<Scene>(evl);
+
+    scene->RegisterComponentList<DataABC>(
+                make_unique<ComponentList<DataABC>>(*scene));
+
+    ComponentList<DataABC>* cmlist_abc =
+            static_cast<ComponentList<DataABC>*>(
+                scene->GetComponentList<DataABC>());
+
+    Profiler::Reset();
+
+    auto prefab = scene->CreateEntity();
+    cmlist_abc->Create(prefab,DataABC(1,2,3));
+    scene->Instantiate(prefab,10);
+    scene->RemoveEntity(prefab);
+
+    auto const ix_abc = Scene::Component<DataABC>::index;
+
+    REQUIRE(Profiler::GetCount(Profiler::Counter::EntitiesCreated) == 11);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::EntitiesRemoved) == 1);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ComponentsCreated,ix_abc) == 11);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ComponentsRemoved,ix_abc) == 1);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations,ix_abc) >= 1);
+
+    // Only resizes that reallocate are counted
+    std::vector<int> list_data;
+    list_data.reserve(100);
+
+    auto const realloc_count =
+            Profiler::GetCount(Profiler::Counter::ListReallocations,ix_abc);
+
+    KS_ECS_PROFILE_RESIZE(ix_abc,list_data,50);
+    KS_ECS_PROFILE_RESIZE(ix_abc,list_data,25);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations,ix_abc) ==
+            realloc_count);
+
+    KS_ECS_PROFILE_RESIZE(ix_abc,list_data,200);
+    REQUIRE(Profiler::GetCount(Profiler::Counter::ListReallocations,ix_abc) ==
+            realloc_count+1);
+#endif
+
+    Profiler::Reset();
+}
+
+TEST_CASE("Profiler buffers","[ecs_profiler_buffers]")
+{
+    using Profiler = ecs::Profiler;
+
+    Profiler::Reset();
+
+    auto record = [](uint count) {
+        for(uint i=0; i < count; i++) {
+            ecs::ProfileScope scope("buffers");
+        }
+    };
+
+    auto count_events = [](std::string const &trace) {
+        std::string const substr = "\"ph\":\"X\"";
+        uint count=0;
+        for(auto pos = trace.find(substr);
+            pos != std::string::npos;
+            pos = trace.find(substr,pos+1)) {
+            count++;
+        }
+        return count;
+    };
+
+    // Buffers from threads that have exited are reused
+    // and their events are kept until they're exported
+    record(1);
+    uint const buffer_count = Profiler::GetThreadBufferCount();
+
+    for(uint i=0; i < 50; i++) {
+        std::vector<std::thread> list_threads;
+        for(uint j=0; j < 4; j++) {
+            list_threads.emplace_back(record,2);
+        }
+        for(auto &thread : list_threads) {
+            thread.join();
+        }
+    }
+
+    REQUIRE(Profiler::GetThreadBufferCount() <= buffer_count+4);
+    REQUIRE(count_events(Profiler::GetChromeTrace()) == 401);
+
+    // Exported events are removed
+    REQUIRE(count_events(Profiler::GetChromeTrace()) == 0);
+
+    // Buffers wrap around and keep the newest events
+    uint const buffer_size = KS_ECS_PROFILE_BUFFER_SIZE;
+    record(buffer_size+100);
+    REQUIRE(count_events(Profiler::GetChromeTrace()) == buffer_size);
+    REQUIRE(Profiler::GetDroppedEventCount() == 100);
+
+    // Exporting and resetting while other threads record
+    std::atomic<bool> done(false);
+    std::vector<std::thread> list_threads;
+    for(uint i=0; i < 2; i++) {
+        list_threads.emplace_back([&]() {
+            while(!done) {
+                ecs::ProfileScope scope("concurrent");
+            }
+        });
+    }
+
+    for(uint i=0; i < 20; i++) {
+        std::string const trace = Profiler::GetChromeTrace();
+        REQUIRE(trace.find("\"name\":\"\"") == std::string::npos);
+        Profiler::Reset();
+    }
+
+    done = true;
+    for(auto &thread : list_threads) {
+        thread.join();
+    }
+
+    Profiler::Reset();
+}
@@ -5,4 +5,6 @@ PATH_KS_ECS = $${PWD}/ks/ecs
 
 # ecs
 HEADERS += \
-    $${PATH_KS_ECS}/KsEcs.hpp
+    $${PATH_KS_ECS}/KsEcs.hpp \
+    $${PATH_KS_ECS}/KsEcsProfiler.hpp \
+    $${PATH_KS_ECS}/KsEcsSpatialIndex.hpp